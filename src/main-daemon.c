@@ -4,17 +4,23 @@
  * @brief The main MSI Keyboard Light Manager daemon source file.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <limits.h>
 #include <math.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
@@ -23,12 +29,54 @@
 
 #define NUM_REGIONS 3
 
+#define MAX_SOURCES 4
+#define SOURCE_LINE_MAX 64
+#define SOURCE_BACKOFF_MIN 1    /* seconds */
+#define SOURCE_BACKOFF_MAX 64   /* seconds */
+#define SOURCE_GRACE_MS 1000    /* milliseconds */
+
+#define BAR_STEPS 256
+#define BAR_GAMMA 2.2f
+
 static bool daemon_running = true;
 
 static unsigned char hue = 20;
 
 static bool dry_run = false;
 
+static bool bar_mode = false;
+
+/**
+ * @brief Bar-graph frames, indexed by load quantized on BAR_STEPS levels.
+ */
+static struct color bar_lut[BAR_STEPS][NUM_REGIONS];
+
+/**
+ * @brief Helper program streaming load values over a pipe.
+ *
+ * The helper is started once through "/bin/sh -c" and writes one value per
+ * line on its standard output, as a percentage in [0..100]. Lines that do
+ * not parse are ignored. A helper that exits (or closes its output) is
+ * restarted after an exponential backoff delay.
+ */
+struct source {
+    const char *cmd;            /**< Shell command line of the helper. */
+    pid_t pid;                  /**< Helper process ID, -1 when not running. */
+    int fd;                     /**< Read end of the helper's stdout pipe, -1 when not running. */
+    char line[SOURCE_LINE_MAX]; /**< Partial line received so far. */
+    size_t len;                 /**< Length of the partial line. */
+    bool overflow;              /**< Current line is too long and is being discarded. */
+    bool valid;                 /**< At least one value has been received. */
+    float value;                /**< Latest received value, in [0..1] interval. */
+    time_t started;             /**< Monotonic time the helper was started at. */
+    time_t restart_at;          /**< Monotonic time the helper may be restarted at. */
+    unsigned int backoff;       /**< Next restart delay, in seconds. */
+};
+
+static struct source sources[MAX_SOURCES];
+
+static int num_sources = 0;
+
 /**
  * @brief SIGTERM signal handler
  */
@@ -208,6 +256,346 @@ static rgb_color_t hsv2rgb(hsv_color_t hsv)
     return rgb;
 }
 
+/**
+ * @brief Precompute bar-graph frames for every quantized load level.
+ *
+ * Load fills regions from left to right: fully covered regions are lit at
+ * full intensity, the partially covered one at a fractional intensity
+ * passed through a gamma stage so that steps look evenly spaced, and the
+ * remaining ones are off.
+ */
+static void bar_lut_init(void)
+{
+    hsv_color_t full_in_hsv = {
+        .h = hue, /** Color hue */
+        .s = (unsigned char)255,
+        .v = (unsigned char)255,
+    };
+    rgb_color_t full_in_rgb = hsv2rgb(full_in_hsv);
+
+    for (int step = 0; step < BAR_STEPS; ++step) {
+        float level = (float)step / (BAR_STEPS - 1) * NUM_REGIONS;
+
+        for (int i = 0; i < NUM_REGIONS; ++i) {
+            float fill = level - i;
+
+            if (fill < 0.f)
+                fill = 0.f;
+            else if (fill > 1.f)
+                fill = 1.f;
+
+            float gain = powf(fill, BAR_GAMMA);
+            struct color *col = &bar_lut[step][i];
+
+            col->profile = custom;
+            col->red   = (unsigned char)roundf(full_in_rgb.r * gain);
+            col->green = (unsigned char)roundf(full_in_rgb.g * gain);
+            col->blue  = (unsigned char)roundf(full_in_rgb.b * gain);
+        }
+    }
+}
+
+/**
+ * @brief Read monotonic clock, in seconds.
+ */
+static time_t monotonic_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * @brief Launch a source helper with its stdout connected to a pipe.
+ *
+ * @param[in,out]  src  Source to start.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int source_start(struct source *src)
+{
+    int fds[2];
+    pid_t pid;
+
+    assert(src);
+
+    /* Also set on failure, so that start errors keep backing off */
+    src->started = monotonic_now();
+
+    if (pipe(fds) < 0)
+        return -1;
+
+    pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        int null_fd;
+
+        /* Own process group, so that the whole pipeline can be signaled */
+        setpgid(0, 0);
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            if (null_fd > STDERR_FILENO)
+                close(null_fd);
+        }
+        if (fds[1] > STDERR_FILENO)
+            close(fds[1]);
+        execl("/bin/sh", "sh", "-c", src->cmd, (char *)NULL);
+        _exit(127);
+    }
+
+    setpgid(pid, pid);
+    close(fds[1]);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    src->pid = pid;
+    src->fd = fds[0];
+    src->len = 0;
+    src->overflow = false;
+
+    syslog(LOG_USER | LOG_INFO, "source \"%s\" started (pid %d).", src->cmd, (int)pid);
+
+    return 0;
+}
+
+/**
+ * @brief Stop a source helper, reap it and schedule its restart.
+ *
+ * @param[in,out]  src  Source to stop.
+ */
+static void source_stop(struct source *src)
+{
+    int status = 0;
+    time_t now = monotonic_now();
+
+    assert(src);
+
+    if (src->fd >= 0) {
+        close(src->fd);
+        src->fd = -1;
+    }
+
+    /* A helper that stayed up long enough is considered healthy again */
+    if (now - src->started >= SOURCE_BACKOFF_MAX)
+        src->backoff = SOURCE_BACKOFF_MIN;
+
+    if (src->pid > 0) {
+        /* Helper is not reaped yet, so its process group ID cannot be reused */
+        kill(-src->pid, SIGKILL);
+        waitpid(src->pid, &status, 0);
+        syslog(LOG_USER | LOG_WARNING, "source \"%s\" exited (status %d), restart in %u s.",
+               src->cmd, WIFEXITED(status) ? WEXITSTATUS(status) : -1, src->backoff);
+        src->pid = -1;
+    }
+
+    src->restart_at = now + src->backoff;
+    src->backoff = src->backoff * 2 > SOURCE_BACKOFF_MAX ? SOURCE_BACKOFF_MAX : src->backoff * 2;
+    src->valid = false;
+}
+
+/**
+ * @brief Parse a line received from a source helper.
+ *
+ * @param[in,out]  src  Source the line belongs to; its value is updated.
+ */
+static void source_parse_line(struct source *src)
+{
+    char *end;
+    float percent;
+
+    src->line[src->len] = '\0';
+    percent = strtof(src->line, &end);
+    if (end == src->line || !isfinite(percent))
+        return;
+
+    if (percent < 0.f)
+        percent = 0.f;
+    else if (percent > 100.f)
+        percent = 100.f;
+
+    src->value = percent / 100.f;
+    src->valid = true;
+}
+
+/**
+ * @brief Read one chunk of pending data from a source helper pipe.
+ *
+ * Reading is bounded so that a helper writing faster than the daemon
+ * reads cannot delay the daemon tick; poll() reports remaining data.
+ *
+ * @param[in,out]  src  Source to read from.
+ *
+ * @return 0 if the helper is still alive, -1 on end of file or read error.
+ */
+static int source_read(struct source *src)
+{
+    char buf[256];
+    ssize_t n;
+
+    n = read(src->fd, buf, sizeof(buf));
+    if (n == 0)
+        return -1;
+    if (n < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+    for (ssize_t i = 0; i < n; ++i) {
+        if (buf[i] == '\n') {
+            if (!src->overflow)
+                source_parse_line(src);
+            src->len = 0;
+            src->overflow = false;
+        } else if (src->len < SOURCE_LINE_MAX - 1) {
+            src->line[src->len++] = buf[i];
+        } else {
+            src->overflow = true;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Wait for source helpers output, restarting crashed ones.
+ *
+ * Also serves as the daemon tick sleep when no source is configured.
+ *
+ * @param[in]  timeout_ms  Time to wait, in milliseconds.
+ */
+static void sources_wait(int timeout_ms)
+{
+    struct pollfd pfds[MAX_SOURCES];
+    int idx[MAX_SOURCES];
+    int nfds = 0;
+    time_t now = monotonic_now();
+
+    for (int i = 0; i < num_sources; ++i) {
+        struct source *src = &sources[i];
+
+        /* Helper may have exited while a background child keeps its output
+           open; it is left unreaped (WNOWAIT) for source_stop() */
+        if (src->pid > 0) {
+            siginfo_t info;
+
+            info.si_pid = 0;
+            if (waitid(P_PID, src->pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0
+                && info.si_pid == src->pid)
+                source_stop(src);
+        }
+
+        if (src->pid < 0 && now >= src->restart_at && source_start(src) < 0) {
+            syslog(LOG_USER | LOG_ERR, "source \"%s\" failed to start.", src->cmd);
+            source_stop(src);
+        }
+        if (src->fd >= 0) {
+            pfds[nfds].fd = src->fd;
+            pfds[nfds].events = POLLIN;
+            idx[nfds++] = i;
+        }
+    }
+
+    struct timespec deadline, ts;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000 * 1000;
+    if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000 * 1000 * 1000;
+    }
+
+    while (daemon_running && timeout_ms > 0) {
+        if (poll(pfds, nfds, timeout_ms) > 0) {
+            for (int j = 0; j < nfds; ++j) {
+                if (pfds[j].fd < 0 || !pfds[j].revents)
+                    continue;
+                if (source_read(&sources[idx[j]]) < 0) {
+                    source_stop(&sources[idx[j]]);
+                    pfds[j].fd = -1;
+                }
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        timeout_ms = (int)((deadline.tv_sec - ts.tv_sec) * 1000
+                         + (deadline.tv_nsec - ts.tv_nsec) / (1000 * 1000));
+    }
+}
+
+/**
+ * @brief Compute load ratio from latest source helpers values.
+ *
+ * @return  Highest value reported by the running helpers, in [0..1] interval.
+ */
+static float sources_value(void)
+{
+    float ratio = 0.f;
+
+    for (int i = 0; i < num_sources; ++i)
+        if (sources[i].valid && sources[i].value > ratio)
+            ratio = sources[i].value;
+
+    return ratio;
+}
+
+/**
+ * @brief Terminate and reap all source helpers.
+ */
+static void sources_shutdown(void)
+{
+    struct timespec wait_time = {
+        .tv_nsec = 10 * 1000 * 1000, /* 10 ms */
+    };
+
+    for (int i = 0; i < num_sources; ++i) {
+        struct source *src = &sources[i];
+
+        if (src->fd >= 0)
+            close(src->fd);
+        src->fd = -1;
+        if (src->pid > 0)
+            kill(-src->pid, SIGTERM);
+    }
+
+    /* Grace period; exited helpers are left unreaped (WNOWAIT) so that
+       their process group ID stays reserved until SIGKILL below */
+    for (int ms = 0; ms < SOURCE_GRACE_MS; ms += 10) {
+        bool alive = false;
+
+        for (int i = 0; i < num_sources; ++i) {
+            siginfo_t info;
+
+            if (sources[i].pid <= 0)
+                continue;
+            info.si_pid = 0;
+            if (waitid(P_PID, sources[i].pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0
+                && info.si_pid == 0)
+                alive = true;
+        }
+        if (!alive)
+            break;
+        nanosleep(&wait_time, NULL);
+    }
+
+    for (int i = 0; i < num_sources; ++i) {
+        struct source *src = &sources[i];
+
+        if (src->pid > 0) {
+            kill(-src->pid, SIGKILL);
+            waitpid(src->pid, NULL, 0);
+        }
+        src->pid = -1;
+    }
+}
+
 /**
  * @brief Prints help information.
  */
@@ -215,7 +603,7 @@ static void usage(char *argv[])
 {
     printf("%s - MSI Keyboard Light Manager daemon", basename(argv[0]));
     puts("");
-    printf("Usage:\%s [-h] [-c h,s,v] [-n]", basename(argv[0]));
+    printf("Usage:\%s [-h] [-c h,s,v] [-n] [-b] [-s command]...", basename(argv[0]));
     puts("");
     puts("Description:");
     puts("");
@@ -224,12 +612,23 @@ static void usage(char *argv[])
     puts("\tno saturation (white color) when system is idle, to full saturation when cpu");
     puts("\tload is 100 %.");
     puts("");
+    puts("\tInstead of the cpu load, the displayed load can be read from helper programs");
+    puts("\tstarted once by the daemon. Each helper writes one value per line on its");
+    puts("\tstandard output, as a percentage in [0..100]; the highest value is displayed.");
+    puts("\tHelpers that exit are restarted with an exponential backoff delay.");
+    puts("");
+    puts("\tIn bar-graph mode, the load fills keyboard regions from left to right");
+    puts("\tinstead, the last lit region being partially dimmed.");
+    puts("");
     puts("Options:");
     puts("\t-h, --help\t\tDisplay this help message.");
     puts("\t-c <hue>");
     puts("\t--color=<hue>\t\tDefines full load hue color. Value must be in [0..255].");
     printf("\t\t\t\tDefault hue value is %d (i.e. orange color).\n", hue);
     puts("\t-n, --dry-run\t\tSet keyboard color without starting the deamon.");
+    puts("\t-b, --bar\t\tDisplay load as a bar-graph across regions.");
+    puts("\t-s <command>");
+    printf("\t--source=<command>\tRead load values from helper command. May be given up to %d times.\n", MAX_SOURCES);
 }
 
 /**
@@ -246,10 +645,12 @@ static void parse_args(int argc, char *argv[])
           {"help", 0, 0, 'h'},
           {"color", 1, 0, 'c'},
           {"dry-run", 0, 0, 'n'},
+          {"source", 1, 0, 's'},
+          {"bar", 0, 0, 'b'},
           {0, 0, 0, 0}
         };
 
-        c = getopt_long(argc, argv, "hc:n",
+        c = getopt_long(argc, argv, "hc:ns:b",
                         long_options, &option_index);
         if (c == -1)
             break;
@@ -277,6 +678,22 @@ static void parse_args(int argc, char *argv[])
         case 'n':
             dry_run = true;
             break;
+
+        case 'b':
+            bar_mode = true;
+            break;
+
+        case 's':
+            if (num_sources >= MAX_SOURCES) {
+                fprintf(stderr, "Too many sources (max %d).\n", MAX_SOURCES);
+                exit(EXIT_FAILURE);
+            }
+            sources[num_sources].cmd = optarg;
+            sources[num_sources].pid = -1;
+            sources[num_sources].fd = -1;
+            sources[num_sources].backoff = SOURCE_BACKOFF_MIN;
+            num_sources++;
+            break;
         }
     }
 }
@@ -350,6 +767,9 @@ int main(int argc, char** argv)
 
     parse_args(argc, argv);
 
+    if (bar_mode)
+        bar_lut_init();
+
     if (!keyboard_found())
     {
         fprintf(stderr, "Fail opening MSI LED keyboard.\n");
@@ -394,10 +814,16 @@ int main(int argc, char** argv)
     if ((chdir("/")) < 0)
         exit(EXIT_FAILURE);
 
-    /* Close out the standard file descriptors */
-    close(STDIN_FILENO);
-    close(STDOUT_FILENO);
-    close(STDERR_FILENO);
+    /* Redirect the standard file descriptors to /dev/null, so that
+       later opened descriptors never take their place */
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd < 0)
+        exit(EXIT_FAILURE);
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    if (null_fd > STDERR_FILENO)
+        close(null_fd);
 
     /* Register SIGTERM handler */
     signal(SIGTERM, sigterm_handler);
@@ -420,31 +846,45 @@ int main(int argc, char** argv)
     unsigned long tot;
     unsigned char timeout = 10; /* seconds */
     while (daemon_running && !ret) {
-        read_proc_stat(&stat_curr);
-
-        stat_entry_calc_delta(&stat_curr, &stat_prev, &use, &tot);
-
-        float ratio = ((float)use) / ((float)tot); /** [0..1] interval */
+        float ratio; /** [0..1] interval */
+
+        if (num_sources) {
+            ratio = sources_value();
+        } else {
+            read_proc_stat(&stat_curr);
+            stat_entry_calc_delta(&stat_curr, &stat_prev, &use, &tot);
+            ratio = ((float)use) / ((float)tot);
+            stat_prev = stat_curr;
+        }
         /*
         float cpu_percent = ratio * 100.0f;
         printf(" cpu: %3.2f %%\n", cpu_percent);
         syslog(loglevel | LOG_DEBUG, " cpu: %3.2f %%\n", cpu_percent);
         */
 
-        hsv_color_t load_in_hsv = {
-            .h = hue, /** Color hue */
-            .s = (unsigned char)roundf(sqrtf(ratio) * 255.f),
-            .v = (unsigned char)255,
-        };
-
-        rgb_color_t load_in_rgb = hsv2rgb(load_in_hsv);
-        colors.red   = (unsigned char)(load_in_rgb.r);
-        colors.green = (unsigned char)(load_in_rgb.g);
-        colors.blue  = (unsigned char)(load_in_rgb.b);
-
-        for (int i = 0; i < num_regions && ret == 0; ++i)
-            if (set_color(dev, colors, i + 1, br) <= 0)
-                ret = -1;
+        if (bar_mode) {
+            int step = ratio > 0.f ? (int)roundf(ratio * (BAR_STEPS - 1)) : 0;
+            const struct color *frame = bar_lut[step < BAR_STEPS ? step : BAR_STEPS - 1];
+
+            for (int i = 0; i < num_regions && ret == 0; ++i)
+                if (set_color(dev, frame[i], i + 1, br) <= 0)
+                    ret = -1;
+        } else {
+            hsv_color_t load_in_hsv = {
+                .h = hue, /** Color hue */
+                .s = (unsigned char)roundf(sqrtf(ratio) * 255.f),
+                .v = (unsigned char)255,
+            };
+
+            rgb_color_t load_in_rgb = hsv2rgb(load_in_hsv);
+            colors.red   = (unsigned char)(load_in_rgb.r);
+            colors.green = (unsigned char)(load_in_rgb.g);
+            colors.blue  = (unsigned char)(load_in_rgb.b);
+
+            for (int i = 0; i < num_regions && ret == 0; ++i)
+                if (set_color(dev, colors, i + 1, br) <= 0)
+                    ret = -1;
+        }
 
         if (ret) {
             syslog(loglevel | LOG_ERR, "%s call to set_color() failed.", basename(argv[0]));
@@ -463,10 +903,10 @@ int main(int argc, char** argv)
                 ret = 0;
             }
         }
-        stat_prev = stat_curr;
-        sleep(1);
+        sources_wait(1000);
     }
 
+    sources_shutdown();
     syslog(loglevel | LOG_INFO, "%s daemon exiting.", basename(argv[0]));
     hid_close(dev);
 